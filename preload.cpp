@@ -0,0 +1,326 @@
+// --------------------------------------------- PRELOAD ---------------------------------------------
+
+/*
+malloc-compatible shim backed by the buddy heap, lets unmodified binaries run on the allocator:
+  g++ -O2 -shared -fPIC -o libbuddy.so preload.cpp
+  LD_PRELOAD=./libbuddy.so ./program
+
+The pool is mmap'd on the first allocation, its size is set by BUDDY_POOL_MB (256 MiB by default,
+also used for values which are not positive numbers),
+BUDDY_OUT_OF_BAND=1 keeps the free list links out of band
+All calls are serialized by one lock, the thread holding the lock owns the heap
+*/
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cstdint>
+#include <cassert>
+#include <cmath>
+#include <climits>
+#include <cerrno>
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <sys/mman.h>
+#include <pthread.h>
+#include <malloc.h>
+
+using namespace std;
+
+// the allocator's internals must not interpose with symbols of the program
+#pragma GCC visibility push(hidden)
+#define __PROGTEST__
+#include "src.cpp"
+#pragma GCC visibility pop
+
+#define SHIM_EXPORT extern "C" __attribute__((visibility("default")))
+
+/// Default size of the pool (in MiB)
+const int SHIM_POOL_MB = 256;
+/// Size of the memory served while the heap is being initialized
+const int SHIM_BOOTSTRAP_SIZE = 65536;
+/// Alignment of valloc / pvalloc blocks
+const size_t SHIM_PAGE_SIZE = 4096;
+
+/// serializes all the calls
+mutex g_shimLock;
+/// set once the heap is initialized
+atomic<bool> g_shimReady(false);
+/// set while the heap is being initialized
+atomic<bool> g_shimInitializing(false);
+/// thread initializing the heap, its allocations are served from the bootstrap memory
+pthread_t g_shimInitThread;
+
+/// memory for allocations made during initialization (never freed)
+alignas(64) uint8_t g_shimBootstrap[SHIM_BOOTSTRAP_SIZE];
+/// bytes of the bootstrap memory used
+size_t g_shimBootstrapUsed = 0;
+
+/// Returns whether the calling thread is initializing the heap
+bool ShimIsBootstrap()
+{
+	return g_shimInitializing.load(memory_order_acquire) && pthread_equal(pthread_self(), g_shimInitThread);
+}
+
+/// Returns whether the pointer belongs to the bootstrap memory
+bool ShimIsBootstrapPtr(void * ptr)
+{
+	return (uint8_t *)ptr >= g_shimBootstrap && (uint8_t *)ptr < g_shimBootstrap + SHIM_BOOTSTRAP_SIZE;
+}
+
+/// Allocates from the bootstrap memory, the size is stored in front of the block
+void * ShimBootstrapAlloc(size_t size)
+{
+	size = (size + 15) & ~(size_t)15;
+	if (g_shimBootstrapUsed + 16 + size > SHIM_BOOTSTRAP_SIZE)
+		return nullptr;
+	uint8_t * block = g_shimBootstrap + g_shimBootstrapUsed;
+	*(size_t *)block = size;
+	g_shimBootstrapUsed += 16 + size;
+	return block + 16;
+}
+
+/// Reads an integer from the environment, 'def' when it is not set
+int ShimEnvInt(const char * name, int def)
+{
+	const char * value = getenv(name);
+	return value && *value ? atoi(value) : def;
+}
+
+/// Maps a pool aligned to its own size, so blocks are aligned to their size
+void * ShimMapPool(int size)
+{
+	// reserve twice as much, trim the unaligned parts
+	uint8_t * area = (uint8_t *)mmap(nullptr, 2 * (size_t)size, PROT_READ | PROT_WRITE,
+		MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	if (area == MAP_FAILED)
+		return nullptr;
+	uint8_t * start = (uint8_t *)(((uintptr_t)area + size - 1) & ~((uintptr_t)size - 1));
+	if (start > area)
+		munmap(area, start - area);
+	munmap(start + size, area + size - start);
+	return start;
+}
+
+void ShimAtForkPrepare() { g_shimLock.lock(); }
+void ShimAtForkRelease() { g_shimLock.unlock(); }
+
+/// Initializes the heap, has to be called with the lock held
+/// Returns success
+bool ShimInit()
+{
+	g_shimInitThread = pthread_self();
+	g_shimInitializing.store(true, memory_order_release);
+
+	// the pool size has to be a power of two
+	int sizeMB = ShimEnvInt("BUDDY_POOL_MB", SHIM_POOL_MB);
+	if (sizeMB <= 0)
+		sizeMB = SHIM_POOL_MB;
+	long long size = (long long)sizeMB << 20;
+	if (size > MAX_BUDDY_SIZE)
+		size = MAX_BUDDY_SIZE;
+	size = MathBuddy::Pow2Int(MathBuddy::Log2Int((int)size));
+	void * pool = ShimMapPool((int)size);
+	bool ready = false;
+	if (pool)
+	{
+		// fresh mapping is zeroed
+		int flags = HEAP_ZEROED;
+		if (ShimEnvInt("BUDDY_OUT_OF_BAND", 0))
+			flags |= HEAP_OUT_OF_BAND;
+		HeapInitEx(pool, (int)size, flags);
+		// the metadata has to fit into the pool
+		ready = g_metaStart != nullptr;
+		if (!ready)
+			munmap(pool, size);
+	}
+
+	g_shimInitializing.store(false, memory_order_release);
+	g_shimReady.store(ready, memory_order_release);
+	return ready;
+}
+
+/// Initializes the heap on the first call
+/// Returns success
+bool ShimEnsureInit()
+{
+	if (g_shimReady.load(memory_order_acquire))
+		return true;
+	bool initialized = false;
+	{
+		lock_guard<mutex> guard(g_shimLock);
+		if (!g_shimReady.load(memory_order_relaxed))
+			initialized = ShimInit();
+	}
+	if (initialized)
+		// may allocate, can't be done with the lock held
+		pthread_atfork(ShimAtForkPrepare, ShimAtForkRelease, ShimAtForkRelease);
+	return g_shimReady.load(memory_order_acquire);
+}
+
+/// Allocates 'size' bytes aligned to 'align'
+void * ShimAlloc(size_t size, size_t align)
+{
+	if (ShimIsBootstrap())
+		return align <= 16 ? ShimBootstrapAlloc(size) : nullptr;
+	// blocks are aligned to their size within the pool
+	if (size < align)
+		size = align;
+	if (size > INT_MAX || !ShimEnsureInit())
+		return nullptr;
+
+	lock_guard<mutex> guard(g_shimLock);
+	g_owner = this_thread::get_id();
+	return HeapAlloc((int)size);
+}
+
+/// Returns whether the pointer belongs to the pool
+bool ShimIsHeapPtr(void * ptr)
+{
+	return g_shimReady.load(memory_order_acquire) && ptr >= g_memStart && ptr < g_end;
+}
+
+/// Returns size of an allocated block, 0 for unknown pointers
+size_t ShimBlockSize(void * ptr)
+{
+	if (ShimIsBootstrapPtr(ptr))
+		return *(size_t *)((uint8_t *)ptr - 16);
+	if (!ShimIsHeapPtr(ptr))
+		return 0;
+	lock_guard<mutex> guard(g_shimLock);
+	int index;
+	return FindBlockSize(ptr, &index);
+}
+
+SHIM_EXPORT void * malloc(size_t size)
+{
+	void * block = ShimAlloc(size, 0);
+	if (!block)
+		errno = ENOMEM;
+	return block;
+}
+
+SHIM_EXPORT void free(void * ptr)
+{
+	// bootstrap memory and foreign pointers are never freed
+	if (!ShimIsHeapPtr(ptr))
+		return;
+	lock_guard<mutex> guard(g_shimLock);
+	g_owner = this_thread::get_id();
+	HeapFree(ptr);
+}
+
+SHIM_EXPORT void * calloc(size_t num, size_t size)
+{
+	if (size && num > SIZE_MAX / size)
+	{
+		errno = ENOMEM;
+		return nullptr;
+	}
+	size_t total = num * size;
+	if (ShimIsBootstrap())
+		// static memory is zeroed
+		return ShimBootstrapAlloc(total);
+	if (total > INT_MAX || !ShimEnsureInit())
+	{
+		errno = ENOMEM;
+		return nullptr;
+	}
+	void * block;
+	{
+		lock_guard<mutex> guard(g_shimLock);
+		g_owner = this_thread::get_id();
+		block = HeapCalloc(1, (int)total);
+	}
+	if (!block)
+		errno = ENOMEM;
+	return block;
+}
+
+SHIM_EXPORT void * realloc(void * ptr, size_t size)
+{
+	if (!ptr)
+		return malloc(size);
+	if (!size)
+	{
+		free(ptr);
+		return nullptr;
+	}
+	size_t oldSize = ShimBlockSize(ptr);
+	if (!oldSize)
+	{
+		// not allocated by the shim, its contents can't be moved
+		errno = EINVAL;
+		return nullptr;
+	}
+	if (size <= oldSize)
+		// still fits into the block
+		return ptr;
+	void * block = malloc(size);
+	if (!block)
+		return nullptr;
+	memcpy(block, ptr, oldSize);
+	free(ptr);
+	return block;
+}
+
+SHIM_EXPORT int posix_memalign(void ** memptr, size_t align, size_t size)
+{
+	if (!align || (align & (align - 1)) || align % sizeof(void *))
+		return EINVAL;
+	void * block = ShimAlloc(size, align);
+	if (!block)
+		return ENOMEM;
+	*memptr = block;
+	return 0;
+}
+
+SHIM_EXPORT void * aligned_alloc(size_t align, size_t size)
+{
+	if (!align || (align & (align - 1)))
+	{
+		errno = EINVAL;
+		return nullptr;
+	}
+	void * block = ShimAlloc(size, align);
+	if (!block)
+		errno = ENOMEM;
+	return block;
+}
+
+SHIM_EXPORT void * memalign(size_t align, size_t size)
+{
+	return aligned_alloc(align, size);
+}
+
+SHIM_EXPORT void * valloc(size_t size)
+{
+	return aligned_alloc(SHIM_PAGE_SIZE, size);
+}
+
+SHIM_EXPORT void * pvalloc(size_t size)
+{
+	// whole pages
+	if (size > SIZE_MAX - SHIM_PAGE_SIZE)
+	{
+		errno = ENOMEM;
+		return nullptr;
+	}
+	return aligned_alloc(SHIM_PAGE_SIZE, size ? (size + SHIM_PAGE_SIZE - 1) & ~(SHIM_PAGE_SIZE - 1) : SHIM_PAGE_SIZE);
+}
+
+SHIM_EXPORT void * reallocarray(void * ptr, size_t num, size_t size)
+{
+	if (size && num > SIZE_MAX / size)
+	{
+		errno = ENOMEM;
+		return nullptr;
+	}
+	return realloc(ptr, num * size);
+}
+
+SHIM_EXPORT size_t malloc_usable_size(void * ptr)
+{
+	return ptr ? ShimBlockSize(ptr) : 0;
+}
@@ -6,11 +6,25 @@
 #include <cstdint>
 #include <cassert>
 #include <cmath>
+#include <chrono>
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
 
 using namespace std;
 
 #endif /* __PROGTEST__ */
 
+// needed by the allocator itself, not provided by the test harness
+#include <climits>
+#include <atomic>
+#include <thread>
+#ifdef __linux__
+#include <sys/mman.h>
+#endif
+
 // --------------------------------------------- BLOCK ---------------------------------------------
 
 struct Block
@@ -23,6 +37,32 @@ struct Block
 	Block * next;
 };
 
+// --------------------------------------------- HANDLE ---------------------------------------------
+
+struct HandleEntry
+{
+	// current address of the block, nullptr when the handle is not used
+	void * addr;
+	// number of active pins, the block can't be moved while pinned
+	int pins;
+	// next unused handle in the table (valid only when the handle is not used)
+	int nextFree;
+};
+
+
+// --------------------------------------------- MARK ---------------------------------------------
+
+struct MarkEntry
+{
+	// block allocated after a mark, nullptr when it was freed already or for the entry of a mark
+	Block * block;
+	// level of the block, -1 when it was freed already, MARK_LEVEL for the entry of a mark
+	int level;
+	// entry of the previous active mark, -1 when there is none (for the entry of a mark)
+	// next entry of the same level while the blocks are released (for the entry of a block)
+	int prevMark;
+};
+
 
 // --------------------------------------------- VARIABLES ---------------------------------------------
 
@@ -31,15 +71,42 @@ Most of the variables are not needed (they are computable from others)
 Storing those values is just a simplification
 */
 
-/// Max number of buddy levels (max size = 16B * 2^31 = 32GiB)
-const int MAX_LEVELS = 32;
-/// Min size of one buddy system block (in bytes)
-const int MIN_SIZE = 16;
+/*
+Geometry of the buddy tree may be set at compile time, e.g. -DBUDDY_MIN_SIZE_LOG=12 -DBUDDY_MAX_LEVELS=19
+for an allocator of 4KiB pages, all the level and index math is then folded into constants
+*/
+
+#ifndef BUDDY_MIN_SIZE_LOG
+#define BUDDY_MIN_SIZE_LOG 4
+#endif
+#ifndef BUDDY_MAX_LEVELS
+#define BUDDY_MAX_LEVELS 32
+#endif
+
+/// Max number of buddy levels (max size = MIN_SIZE * 2^(MAX_LEVELS-1))
+const int MAX_LEVELS = BUDDY_MAX_LEVELS;
 /// log2(MIN_SIZE)
-const int MIN_SIZE_LOG = 4;
+const int MIN_SIZE_LOG = BUDDY_MIN_SIZE_LOG;
+/// Min size of one buddy system block (in bytes)
+const int MIN_SIZE = 1 << MIN_SIZE_LOG;
+/// Max size of the entire buddy block (in bytes), at most 1GiB as sizes are int
+const long long MAX_BUDDY_SIZE = MAX_LEVELS + MIN_SIZE_LOG - 1 < 30 ? 1LL << (MAX_LEVELS + MIN_SIZE_LOG - 1) : 1LL << 30;
+
+static_assert(MIN_SIZE >= (int)sizeof(Block), "free blocks have to hold their header");
+static_assert(MAX_LEVELS + MIN_SIZE_LOG - 1 < 62, "buddy block size out of range");
+
+/// log2 of the smallest block whose free list link may be kept out of band
+const int OOB_MIN_SIZE_LOG = MIN_SIZE_LOG > 6 ? MIN_SIZE_LOG : 6;
+/// Marks the end of an out-of-band free list
+const uint32_t OOB_NONE = 0xffffffff;
+/// Level of the log entries which stand for marks
+const int MARK_LEVEL = -2;
 
 /// linked lists for each level
 Block * g_freeBlocks[MAX_LEVELS];
+/// out-of-band links of the free lists (indexed by block offset / 2^OOB_MIN_SIZE_LOG)
+/// nullptr when all the links are stored in the blocks
+uint32_t * g_freeNext = nullptr;
 /// Actual number of levels the buddy system is using
 int g_levelsNum = 0;
 
@@ -53,6 +120,8 @@ void * g_buddyStart = nullptr;
 void * g_metaStart = nullptr;
 /// address of the split part of the metadata
 void * g_metaSplitStart = nullptr;
+/// address of the clean part of the metadata (only for heaps initialized with zeroed memory)
+void * g_metaCleanStart = nullptr;
 
 /// size of the given block
 int g_memSize = 0;
@@ -64,6 +133,168 @@ int g_metaSize = 0;
 /// Number of blocks allocated in the pool
 int g_blocksPending = 0;
 
+/// Size of a huge page (in bytes)
+const int HUGE_PAGE_SIZE = 2 * 1048576;
+
+/// address of the memory mapped by HeapInitMapped
+void * g_mapStart = nullptr;
+/// size of the mapped memory
+size_t g_mapSize = 0;
+/// page flags the mapped memory got (HEAP_HUGETLB, HEAP_HUGE_PAGES when the kernel may back it with
+/// transparent huge pages, or 0)
+int g_mapFlags = 0;
+
+/// Number of remote frees which make the owner drain the queue
+const int REMOTE_DRAIN_THRESHOLD = 64;
+
+/// thread which owns the heap (the one which initialized it)
+thread::id g_owner;
+/// lock-free stack of blocks freed by other threads, drained by the owner
+atomic<Block *> g_remoteFrees(nullptr);
+/// number of blocks waiting in the remote stack
+atomic<int> g_remoteCount(0);
+
+/// table of relocatable allocations (allocated on the heap itself)
+HandleEntry * g_handles = nullptr;
+/// number of entries the handle table can hold
+int g_handlesCap = 0;
+/// first unused entry of the handle table, -1 when the table is full
+int g_handlesFree = -1;
+/// number of used entries of the handle table
+int g_handlesUsed = 0;
+/// handle where the next compaction pass continues
+int g_compactCursor = 0;
+
+/// log of marks and blocks allocated since the first active mark (allocated on the heap itself)
+MarkEntry * g_markLog = nullptr;
+/// number of entries in the log
+int g_markLogSize = 0;
+/// number of entries the log can hold
+int g_markLogCap = 0;
+/// entry of the last mark which was not released yet, -1 when no mark is active
+int g_markTop = -1;
+/// open addressing table of the log entries keyed by block address (allocated on the heap itself)
+/// lets HeapFree find the entry of a block in constant time, -1 marks an empty slot
+int * g_markIndex = nullptr;
+/// number of slots of the table (power of two, twice the log capacity)
+int g_markIndexCap = 0;
+/// number of log entries added to the table, the rest is added by the first HeapFree which needs it
+int g_markIndexed = 0;
+
+// --------------------------------------------- TRACING ---------------------------------------------
+
+/*
+Compiled only with BUDDY_TRACE defined, otherwise all the macros expand to nothing
+Static USDT probes (provider 'buddy') are emitted when <sys/sdt.h> is available:
+  alloc(level, splits), free(level, merges), split(level), merge(level), remove_scan(level, steps), mark_bits(bits)
+Every BUDDY_TRACE_SAMPLE-th alloc/free is timed using the cycle counter
+*/
+
+#ifdef BUDDY_TRACE
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#else
+#include <ctime>
+#endif
+
+#if defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define TRACE_PROBE1(name, a) DTRACE_PROBE1(buddy, name, a)
+#define TRACE_PROBE2(name, a, b) DTRACE_PROBE2(buddy, name, a, b)
+#endif
+#endif
+#ifndef TRACE_PROBE1
+#define TRACE_PROBE1(name, a)
+#define TRACE_PROBE2(name, a, b)
+#endif
+
+#ifndef BUDDY_TRACE_SAMPLE
+/// Every n-th operation is timed
+#define BUDDY_TRACE_SAMPLE 64
+#endif
+
+/// Operations with a latency histogram
+enum TraceOp
+{
+	TRACE_ALLOC,
+	TRACE_FREE,
+	TRACE_OPS
+};
+
+/// Number of log2 buckets of a histogram
+const int TRACE_BUCKETS = 64;
+
+/// log2 histograms of sampled cycles per operation and level
+uint64_t g_traceCycles[TRACE_OPS][MAX_LEVELS][TRACE_BUCKETS];
+/// number of splits made by one allocation
+uint64_t g_traceSplitDepth[MAX_LEVELS];
+/// number of merges made by one free
+uint64_t g_traceMergeDepth[MAX_LEVELS];
+/// log2 histogram of blocks visited by RemoveFree
+uint64_t g_traceRemoveScan[TRACE_BUCKETS];
+/// log2 histogram of bits set by MarkBits
+uint64_t g_traceMarkBits[TRACE_BUCKETS];
+
+/// number of operations seen (used for sampling)
+uint64_t g_traceOps = 0;
+/// splits, merges and visited blocks of the current operation
+int g_traceSplits = 0;
+int g_traceMerges = 0;
+int g_traceScan = 0;
+
+/// Reads the cycle counter (nanoseconds on platforms without one)
+inline uint64_t TraceClock()
+{
+#if defined(__x86_64__) || defined(__i386__)
+	return __rdtsc();
+#else
+	timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+#endif
+}
+
+/// Returns index of a log2 bucket for the value
+inline int TraceBucket(uint64_t value)
+{
+	return 63 - __builtin_clzll(value | 1);
+}
+
+/// Starts timing of an operation, returns 0 when the operation is not sampled
+inline uint64_t TraceStart()
+{
+	return ++g_traceOps % BUDDY_TRACE_SAMPLE == 0 ? TraceClock() : 0;
+}
+
+/// Finishes timing of a sampled operation
+inline void TraceStop(int op, int level, uint64_t start)
+{
+	if (start && level >= 0 && level < MAX_LEVELS)
+		g_traceCycles[op][level][TraceBucket(TraceClock() - start)]++;
+}
+
+#define TRACE_START() uint64_t traceStart = TraceStart()
+#define TRACE_STOP(op, level) TraceStop(op, level, traceStart)
+#define TRACE_RESET(counter) (counter) = 0
+#define TRACE_COUNT(counter) (counter)++
+#define TRACE_DEPTH(hist, value) (hist)[(value) < MAX_LEVELS ? (value) : MAX_LEVELS - 1]++
+#define TRACE_HIST(hist, value) (hist)[TraceBucket(value)]++
+
+#else
+
+#define TRACE_PROBE1(name, a)
+#define TRACE_PROBE2(name, a, b)
+#define TRACE_START()
+#define TRACE_STOP(op, level)
+#define TRACE_RESET(counter)
+#define TRACE_COUNT(counter)
+#define TRACE_DEPTH(hist, value)
+#define TRACE_HIST(hist, value)
+
+#endif /* BUDDY_TRACE */
+
 // --------------------------------------------- MATH ---------------------------------------------
 
 class MathBuddy
@@ -72,17 +303,8 @@ public:
 	/// Counts log2 of an integer, rounds to the ceiling
 	static int Log2Int(int num)
 	{
-		int res = 0;
-		// is num power of 2? 
-		bool perfect = num % 2 == 0 || num == 1;
-		// count simple log2(n)
-		while (num >>= 1)
-		{
-			res++;
-			perfect = perfect && (num % 2 == 0 || num == 1);
-		}
-		// add one in case size was not perfect power of 2
-		return perfect ? res : res + 1;
+		// log2 of (num - 1) rounded down + 1 (0 for num <= 1)
+		return num <= 1 ? 0 : 32 - __builtin_clz((unsigned)num - 1);
 	}
 
 	/// Simple power of 2 function for integers
@@ -94,24 +316,14 @@ public:
 	/// Returns true when 'num' is any power of 2, otherwise false
 	static bool IsPow2(int num)
 	{
-		do
-		{
-			if (num != 1 && num % 2 == 1)
-				return false;
-		} while (num >>= 1);
-		return true;
+		return (num & (num - 1)) == 0;
 	}
 
 	/// Returns max size of a block (in bytes) which can begin on specified address
 	static int MaxBlockSizeByAddr(int num)
 	{
-		int div = 1;
-		while (num % 2 == 0)
-		{
-			div <<= 1;
-			num >>= 1;
-		}
-		return div;
+		// lowest bit set
+		return num & -num;
 	}
 
 	/// Counts linked list's index in the global array based log2 of the memory needed (exponent)
@@ -147,8 +359,11 @@ public:
 	}
 
 	/// Counts level of a block based on its size 
+	/// Sizes below MIN_SIZE belong to the leaf level
 	static int SizeToLevel(int size)
 	{
+		if (size < MIN_SIZE)
+			size = MIN_SIZE;
 		return MAX_LEVELS + MIN_SIZE_LOG - Log2Int(size) - 1;
 	}
 
@@ -188,7 +403,7 @@ public:
 	/// Returns level of a block with specified global index
 	static int IndexGlobalToLevel(int index)
 	{
-		int lg = (int)log2(index + 1);
+		int lg = 31 - __builtin_clz((unsigned)index + 1);
 		return MAX_LEVELS - g_levelsNum + lg;
 	}
 
@@ -198,13 +413,15 @@ public:
 	{
 		if (level == -1)
 			level = SizeToLevel(block->size);
+		// size is counted from the level, allocated blocks don't carry a valid header
+		int size = LevelToSize(level);
 		int index = IndexWithinLevel(block, level);
 
 		if (index % 2 == 0)
 		{
 			// buddy's on the right
-			uint8_t * addr = (uint8_t *)block + block->size;
-			if (addr + block->size > (uint8_t *)g_end)
+			uint8_t * addr = (uint8_t *)block + size;
+			if (addr + size > (uint8_t *)g_end)
 				// off bounds
 				return nullptr;
 			return (Block *)(addr);
@@ -212,7 +429,7 @@ public:
 		else
 		{
 			// buddy's on the left 
-			uint8_t * addr = (uint8_t *)block - block->size;
+			uint8_t * addr = (uint8_t *)block - size;
 			if (addr < (uint8_t *)g_memStart)
 				// off bounds
 				return nullptr;
@@ -226,6 +443,8 @@ public:
 
 #ifndef __PROGTEST__
 
+Block * NextFree(Block * block, int level);
+
 /// Prints info about free block in the memory
 void DebugBuddySystemInfo()
 {
@@ -261,9 +480,9 @@ void DebugBuddySystemInfo()
 			printf("addr: (buddy_rel: %d, mem_rel: %d, addr: %d), index: (global: %d, level: %d), size: %d",
 				(int)((uint8_t *)tmp - (uint8_t *)g_buddyStart), (int)((uint8_t *)tmp - (uint8_t *)g_memStart), (int)(long int)tmp,
 				MathBuddy::IndexGlobal(tmp, i), MathBuddy::IndexWithinLevel(tmp, i),
-				tmp->size);
-			sum += tmp->size;
-			tmp = tmp->next;
+				MathBuddy::LevelToSize(i));
+			sum += MathBuddy::LevelToSize(i);
+			tmp = NextFree(tmp, i);
 		}
 		printf("\n");
 	}
@@ -298,6 +517,52 @@ void DebugBuddySystemMeta(int bytesPerRow = 16)
 	printf("\n");
 }
 
+#ifdef BUDDY_TRACE
+
+/// Prints non-empty buckets of a log2 histogram
+void DebugTraceHist(const char * name, uint64_t * hist, int buckets)
+{
+	printf("  %s:", name);
+	for (int i = 0; i < buckets; i++)
+		if (hist[i])
+			printf(" [%llu..%llu]: %llu", i ? 1ULL << i : 0ULL, (2ULL << i) - 1, (unsigned long long)hist[i]);
+	printf("\n");
+}
+
+/// Prints all collected trace histograms
+void DebugTraceInfo()
+{
+	printf("\n* TRACE (1/%d operations timed) *\n\n", BUDDY_TRACE_SAMPLE);
+	const char * opNames[TRACE_OPS] = { "alloc", "free" };
+	for (int op = 0; op < TRACE_OPS; op++)
+		for (int level = 0; level < MAX_LEVELS; level++)
+		{
+			uint64_t * hist = g_traceCycles[op][level];
+			bool used = false;
+			for (int i = 0; i < TRACE_BUCKETS; i++)
+				used = used || hist[i];
+			if (!used)
+				continue;
+			char name[64];
+			snprintf(name, sizeof(name), "%s cycles, level %d (%d B)", opNames[op], level, MathBuddy::LevelToSize(level));
+			DebugTraceHist(name, hist, TRACE_BUCKETS);
+		}
+	printf("  split depth:");
+	for (int i = 0; i < MAX_LEVELS; i++)
+		if (g_traceSplitDepth[i])
+			printf(" [%d]: %llu", i, (unsigned long long)g_traceSplitDepth[i]);
+	printf("\n  merge depth:");
+	for (int i = 0; i < MAX_LEVELS; i++)
+		if (g_traceMergeDepth[i])
+			printf(" [%d]: %llu", i, (unsigned long long)g_traceMergeDepth[i]);
+	printf("\n");
+	DebugTraceHist("RemoveFree blocks visited", g_traceRemoveScan, TRACE_BUCKETS);
+	DebugTraceHist("MarkBits bits", g_traceMarkBits, TRACE_BUCKETS);
+	printf("\n");
+}
+
+#endif /* BUDDY_TRACE */
+
 #endif /* __PROGTEST__ */
 
 // --------------------------------------------- FUNCTIONS ---------------------------------------------
@@ -314,10 +579,78 @@ void ResetAllocator()
 	g_buddyStart = nullptr;
 	g_metaStart = nullptr;
 	g_metaSplitStart = nullptr;
+	g_metaCleanStart = nullptr;
+	g_freeNext = nullptr;
 	g_memSize = 0;
 	g_buddySize = 0;
 	g_metaSize = 0;
 	g_blocksPending = 0;
+	g_handles = nullptr;
+	g_handlesCap = 0;
+	g_handlesFree = -1;
+	g_handlesUsed = 0;
+	g_compactCursor = 0;
+	g_markLog = nullptr;
+	g_markLogSize = 0;
+	g_markLogCap = 0;
+	g_markTop = -1;
+	g_markIndex = nullptr;
+	g_markIndexCap = 0;
+	g_markIndexed = 0;
+	g_owner = thread::id();
+	g_remoteFrees.store(nullptr);
+	g_remoteCount.store(0);
+}
+
+/// Returns whether free list links on specified level are kept out of band
+/// Smaller blocks share cache lines with their neighbours, they keep the link inside
+bool IsOutOfBand(int level)
+{
+	return g_freeNext && level <= MathBuddy::ExpToLevel(OOB_MIN_SIZE_LOG);
+}
+
+/// Returns next block in a free list of specified level
+Block * NextFree(Block * block, int level)
+{
+	if (!IsOutOfBand(level))
+		return block->next;
+	uint32_t next = g_freeNext[((uint8_t *)block - (uint8_t *)g_buddyStart) >> OOB_MIN_SIZE_LOG];
+	if (next == OOB_NONE)
+		return nullptr;
+	return (Block *)((uint8_t *)g_buddyStart + ((size_t)next << OOB_MIN_SIZE_LOG));
+}
+
+/// Links next block in a free list of specified level
+void SetNextFree(Block * block, Block * next, int level)
+{
+	if (!IsOutOfBand(level))
+	{
+		block->next = next;
+		return;
+	}
+	uint32_t index = OOB_NONE;
+	if (next)
+		index = (uint32_t)(((uint8_t *)next - (uint8_t *)g_buddyStart) >> OOB_MIN_SIZE_LOG);
+	g_freeNext[((uint8_t *)block - (uint8_t *)g_buddyStart) >> OOB_MIN_SIZE_LOG] = index;
+}
+
+/// Stores size of a free block into its header (blocks with out-of-band links have no header)
+void SetFreeSize(Block * block, int level)
+{
+	if (!IsOutOfBand(level))
+		block->size = MathBuddy::LevelToSize(level);
+}
+
+/// Releases memory mapped by HeapInitMapped
+void UnmapPool()
+{
+#ifdef __linux__
+	if (g_mapStart)
+		munmap(g_mapStart, g_mapSize);
+#endif
+	g_mapStart = nullptr;
+	g_mapSize = 0;
+	g_mapFlags = 0;
 }
 
 /// Adds free memory block to corresponding linked list (based on the level)
@@ -328,7 +661,7 @@ void AddFree(Block * block, int level)
 	// add new block to the beggining of a list
 	Block * former = g_freeBlocks[level];
 	g_freeBlocks[level] = block;
-	block->next = former;
+	SetNextFree(block, former, level);
 }
 
 /// Tries to remove a block from a corresponding linked list (based on the level)
@@ -337,6 +670,7 @@ bool RemoveFree(Block * block, int level)
 {
 	// simple deletion from a linked list
 
+	TRACE_RESET(g_traceScan);
 	Block* tmp = g_freeBlocks[level];
 	if (!tmp)
 		// empty list
@@ -344,21 +678,23 @@ bool RemoveFree(Block * block, int level)
 	if (tmp == block)
 	{
 		// match with first element
-		g_freeBlocks[level] = tmp->next;
+		g_freeBlocks[level] = NextFree(tmp, level);
 		return true;
 	}
 
 	// go through the list
 	while (tmp)
 	{
-		if (block == tmp->next)
+		Block * next = NextFree(tmp, level);
+		if (block == next)
 		{
 			// delete
-			tmp->next = block->next;
+			SetNextFree(tmp, NextFree(block, level), level);
 			return true;
 		}
 		// move
-		tmp = tmp->next;
+		tmp = next;
+		TRACE_COUNT(g_traceScan);
 	}
 
 	return false;
@@ -393,6 +729,8 @@ uint8_t GetZeroAt(int n)
 /// Marks 'numBits' leafs as either taken or free (based on 'asOnes'), staring with the 'startBit'th
 void MarkBits(void * container, int startBit, int numBits, bool asOnes)
 {
+	TRACE_HIST(g_traceMarkBits, numBits);
+	TRACE_PROBE1(mark_bits, numBits);
 	int firstByte = startBit / 8, firstBit = startBit % 8;
 	uint8_t * currentByte = (uint8_t *)container + firstByte;
 	// make change within 1 byte
@@ -483,6 +821,32 @@ bool IsSplit(int index)
 	return *byte & GetOneAt(index % 8);
 }
 
+/// Marks free block of specified global index as clean (zeroed except its header) or dirty
+void MarkClean(int index, bool clean)
+{
+	if (!g_metaCleanStart)
+		return;
+	// find related byte
+	uint8_t * byte = (uint8_t *)g_metaCleanStart + (index / 8);
+	// set related bit
+	if (clean)
+		*byte |= GetOneAt(index % 8);
+	else
+		*byte &= GetZeroAt(index % 8);
+}
+
+/// Returns whether a free block of specified global index is zeroed except its header
+/// Valid only while the block is free
+bool IsClean(int index)
+{
+	if (!g_metaCleanStart)
+		return false;
+	// find related byte
+	uint8_t * byte = (uint8_t *)g_metaCleanStart + (index / 8);
+	// check related bit's value
+	return *byte & GetOneAt(index % 8);
+}
+
 /// Returns whether the leaf of specified index (within the leaf level) is taken or not
 bool IsLeafTaken(int leafIndex)
 {
@@ -519,7 +883,7 @@ void MarkAlloc(Block * block, int level)
 		// count block's offset from the begginging
 		int offset = (int)((uint8_t *)block - (uint8_t *)g_buddyStart);
 		// mark all leafs it covers
-		MarkTaken(offset / MIN_SIZE, block->size / MIN_SIZE);
+		MarkTaken(offset / MIN_SIZE, MathBuddy::LevelToSize(level) / MIN_SIZE);
 	}
 }
 
@@ -575,14 +939,14 @@ void InitMeta()
 		MarkFree(0, leafsTotal);
 
 	// mark space taken by the metadata 
-	int startLeaf = (int)((uint8_t *)g_metaStart - (uint8_t *)g_buddyStart) / (MIN_SIZE * 8);
+	int startLeaf = (int)((uint8_t *)g_metaStart - (uint8_t *)g_buddyStart) / MIN_SIZE;
 	MarkTaken(startLeaf, g_metaSize / MIN_SIZE);
 
 	// mark split nodes
 	int bitsSet = 0;
 	int numBlocksInLevel = 1;
 	float ratio = ratioTaken;
-	void * start = (void *)((uint8_t *)g_metaStart + g_metaSize / 2);
+	void * start = g_metaSplitStart;
 	// set metadata level after level
 	for (int i = 0; i < g_levelsNum - 1; i++, ratio *= 2, numBlocksInLevel *= 2)
 	{
@@ -602,15 +966,15 @@ void InitMeta()
 /// When there is none, tries to split blocks of higher levels to create one
 Block * AllocOnLevel(int level)
 {
-	// required block is bigger than the max block possible
-	if (level < (MAX_LEVELS - g_levelsNum))
+	// required block is bigger than the max block possible or smaller than a leaf
+	if (level < (MAX_LEVELS - g_levelsNum) || level >= MAX_LEVELS)
 		return nullptr;
 
 	Block * block = g_freeBlocks[level];
 	if (block)
 	{
 		// use first free block
-		g_freeBlocks[level] = block->next;
+		g_freeBlocks[level] = NextFree(block, level);
 		return block;
 	}
 	else
@@ -622,13 +986,16 @@ Block * AllocOnLevel(int level)
 		// mark as split
 		int index = MathBuddy::IndexGlobal(first, level - 1);
 		MarkSplit(index);
-		// resize original block
-		int size = first->size / 2;
-		first->size = size;
+		TRACE_COUNT(g_traceSplits);
+		TRACE_PROBE1(split, level - 1);
 		// add new block (unused half of the original one)
-		Block * second = (Block *)((uint8_t *)first + size);
-		second->size = size;
+		Block * second = (Block *)((uint8_t *)first + MathBuddy::LevelToSize(level));
+		SetFreeSize(second, level);
 		AddFree(second, level);
+		// both halves of a clean block only have their headers written
+		bool clean = IsClean(index);
+		MarkClean(MathBuddy::IndexGlobal(first, level), clean);
+		MarkClean(MathBuddy::IndexGlobal(second, level), clean);
 
 		return first;
 	}
@@ -638,78 +1005,485 @@ Block * AllocOnLevel(int level)
 /// Returns nullptr where there is not enough space
 Block * BuddyAlloc(int level)
 {
+	TRACE_START();
+	TRACE_RESET(g_traceSplits);
 	Block * block = AllocOnLevel(level);
 	if (block)
 		MarkAlloc(block, level);
+	TRACE_STOP(TRACE_ALLOC, level);
+	TRACE_DEPTH(g_traceSplitDepth, g_traceSplits);
+	TRACE_PROBE2(alloc, level, g_traceSplits);
 	return block;
 }
 
-/// Tries to free a block on specified address
-/// Returns success
-bool TryFreeBlock(void * addr)
+/// Finds size of a block beginning on specified address using the split bitmap
+/// Stores global index of the block into 'index'
+/// Returns 0 when there can't be any block on the address
+int FindBlockSize(void * addr, int * index)
 {
 	int offset = (int)((uint8_t *)addr - (uint8_t *)g_buddyStart);
-	if (offset % MIN_SIZE != 0)
+	if (offset <= 0 || offset % MIN_SIZE != 0)
 		// cannot be a block
-		return false;
+		return 0;
 	// find biggest block which is not split
 	int size = MathBuddy::MaxBlockSizeByAddr(offset);
-	int index = MathBuddy::IndexGlobal((Block *)addr, MathBuddy::SizeToLevel(size));
+	*index = MathBuddy::IndexGlobal((Block *)addr, MathBuddy::SizeToLevel(size));
 	// keep trying smaller blocks until the correct one is found
-	while (IsSplit(index))
+	while (IsSplit(*index))
 	{
-		index = MathBuddy::ChildIndex(index);
+		*index = MathBuddy::ChildIndex(*index);
 		size /= 2;
 	}
-	if (!IsTaken(index))
-		// block is free already
-		return false;
+	return size;
+}
+
+/// Returns whether a block of specified global index is free and not split
+bool IsFreeNode(int index)
+{
+	return !IsSplit(index) && !IsTaken(index);
+}
+
+/// Tries to free a block on specified address
+/// Returns size of the freed block, 0 when it can't be freed
+int TryFreeBlock(void * addr)
+{
+	int index;
+	int size = FindBlockSize(addr, &index);
+	if (!size || !IsTaken(index))
+		// not a block or the block is free already
+		return 0;
 	// create free block
 	Block * block = (Block *)addr;
-	block->size = size;
+	SetFreeSize(block, MathBuddy::SizeToLevel(size));
+	MarkClean(index, false);
 	// mark as free
 	int leafIndex = MathBuddy::IndexWithinLevel(block, MAX_LEVELS - 1);
 	MarkFree(leafIndex, size / MIN_SIZE);
 
-	return true;
+	return size;
 }
 
-/// Merges a block with its buddy using recursion
-/// Returns pointer to resulting block
-Block * Merge(Block * block)
+/// Merges a free block of level '*level' with its buddy using recursion
+/// Returns pointer to resulting block, its level is stored into 'level'
+Block * Merge(Block * block, int * level)
 {
-	Block * buddy = MathBuddy::FindBuddy(block);
+	Block * buddy = MathBuddy::FindBuddy(block, *level);
 	if (!buddy)
 		return block;
 	// try to remove
-	int level = MathBuddy::SizeToLevel(block->size);
-	if (RemoveFree(buddy, level))
+	bool removed = RemoveFree(buddy, *level);
+	TRACE_HIST(g_traceRemoveScan, g_traceScan);
+	TRACE_PROBE2(remove_scan, *level, g_traceScan);
+	if (removed)
 	{
 		// success -> buddy was free, merge
 		Block * merged = block < buddy ? block : buddy;
-		merged->size *= 2;
+		bool clean = IsClean(MathBuddy::IndexGlobal(block, *level))
+			&& IsClean(MathBuddy::IndexGlobal(buddy, *level));
+		if (clean && !IsOutOfBand(*level))
+			// header of the right half ends up inside the merged block
+			memset((void *)(block < buddy ? buddy : block), 0, sizeof(Block));
+		(*level)--;
+		SetFreeSize(merged, *level);
 		// mark as merged
-		int index = MathBuddy::IndexGlobal(merged, level - 1);
+		int index = MathBuddy::IndexGlobal(merged, *level);
 		MarkMerged(index);
+		MarkClean(index, clean);
+		TRACE_COUNT(g_traceMerges);
+		TRACE_PROBE1(merge, *level);
 		// Try to merge with another 
-		return Merge(merged);
+		return Merge(merged, level);
 	}
 	// buddy is not free
 	return block;
 }
 
+/// Frees a block on specified address and merges it with its buddies
+/// Returns success
+bool FreeBlock(void * addr)
+{
+	TRACE_START();
+	TRACE_RESET(g_traceMerges);
+	int size = TryFreeBlock(addr);
+	if (!size)
+		return false;
+	// merge new block
+	int level = MathBuddy::SizeToLevel(size);
+	Block * merged = Merge((Block *)addr, &level);
+	// add it to corresponding list
+	AddFree(merged, level);
+	TRACE_STOP(TRACE_FREE, MathBuddy::SizeToLevel(size));
+	TRACE_DEPTH(g_traceMergeDepth, g_traceMerges);
+	TRACE_PROBE2(free, MathBuddy::SizeToLevel(size), g_traceMerges);
+	return true;
+}
+
+/// Moves internal structure into a new block of 'newSize' bytes allocated on the heap
+/// Returns nullptr when there is not enough space (the old block stays untouched)
+void * InternalRealloc(void * old, int oldSize, int newSize)
+{
+	Block * block = BuddyAlloc(MathBuddy::SizeToLevel(newSize));
+	if (!block)
+		return nullptr;
+	if (old)
+	{
+		memcpy(block, old, oldSize);
+		FreeBlock(old);
+	}
+	return block;
+}
+
+/// Returns home slot of a block in the table of the log entries
+int MarkIndexSlot(void * addr)
+{
+	uint32_t hash = (uint32_t)(((uint8_t *)addr - (uint8_t *)g_buddyStart) >> MIN_SIZE_LOG) * 2654435761u;
+	return (int)((hash ^ (hash >> 16)) & (g_markIndexCap - 1));
+}
+
+/// Adds a log entry to the table of the log entries
+void IndexLogEntry(int entry)
+{
+	int slot = MarkIndexSlot(g_markLog[entry].block);
+	while (g_markIndex[slot] >= 0)
+		slot = (slot + 1) & (g_markIndexCap - 1);
+	g_markIndex[slot] = entry;
+}
+
+/// Finds slot of a block in the table of the log entries
+/// Returns -1 when the block is not logged
+int FindLogSlot(void * addr)
+{
+	for (int slot = MarkIndexSlot(addr); g_markIndex[slot] >= 0; slot = (slot + 1) & (g_markIndexCap - 1))
+		if (g_markLog[g_markIndex[slot]].block == addr)
+			return slot;
+	return -1;
+}
+
+/// Empties a slot of the table of the log entries, following entries are shifted back
+/// so no probe sequence is broken
+void UnindexLogSlot(int slot)
+{
+	int mask = g_markIndexCap - 1;
+	for (int next = (slot + 1) & mask; g_markIndex[next] >= 0; next = (next + 1) & mask)
+	{
+		int home = MarkIndexSlot(g_markLog[g_markIndex[next]].block);
+		// the entry can fill the hole only when the hole lies between its home and its slot
+		if (((next - home) & mask) >= ((next - slot) & mask))
+		{
+			g_markIndex[slot] = g_markIndex[next];
+			slot = next;
+		}
+	}
+	g_markIndex[slot] = -1;
+}
+
+/// Appends an entry to the log, space for it in the table of the log entries is reserved
+/// Returns index of the entry, -1 when there is not enough space
+int LogAlloc(Block * block, int level)
+{
+	if (g_markLogSize == g_markLogCap)
+	{
+		// double the log
+		int cap = g_markLogCap ? g_markLogCap * 2 : 64;
+		MarkEntry * log = (MarkEntry *)InternalRealloc(g_markLog,
+			g_markLogSize * (int)sizeof(MarkEntry), cap * (int)sizeof(MarkEntry));
+		if (!log)
+			return -1;
+		g_markLog = log;
+		g_markLogCap = cap;
+	}
+	if (g_markIndexCap < 2 * g_markLogCap)
+	{
+		// new table for the new capacity, filled again when needed
+		int cap = 2 * g_markLogCap;
+		int * index = (int *)InternalRealloc(g_markIndex, 0, cap * (int)sizeof(int));
+		if (!index)
+			return -1;
+		g_markIndex = index;
+		g_markIndexCap = cap;
+		g_markIndexed = 0;
+		memset(g_markIndex, 0xff, cap * sizeof(int));
+	}
+	int entry = g_markLogSize++;
+	g_markLog[entry].block = block;
+	g_markLog[entry].level = level;
+	g_markLog[entry].prevMark = -1;
+	return entry;
+}
+
+/// Drops freed entries at the end of the log, the entries of active marks stay
+void TrimLog()
+{
+	while (g_markLogSize > g_markTop + 1 && !g_markLog[g_markLogSize - 1].block)
+		g_markLogSize--;
+	if (g_markIndexed > g_markLogSize)
+		g_markIndexed = g_markLogSize;
+}
+
+/// Frees the log once no mark is active
+void FreeLogIfUnused()
+{
+	if (g_markTop >= 0)
+		return;
+	if (g_markLog)
+		FreeBlock(g_markLog);
+	if (g_markIndex)
+		FreeBlock(g_markIndex);
+	g_markLog = nullptr;
+	g_markLogSize = 0;
+	g_markLogCap = 0;
+	g_markIndex = nullptr;
+	g_markIndexCap = 0;
+	g_markIndexed = 0;
+}
+
+/// Removes a block freed by the user from the log
+void UnlogAlloc(void * addr)
+{
+	// allocations made since the last free aren't in the table yet
+	for (; g_markIndexed < g_markLogSize; g_markIndexed++)
+		if (g_markLog[g_markIndexed].block)
+			IndexLogEntry(g_markIndexed);
+	int slot = FindLogSlot(addr);
+	if (slot < 0)
+		return;
+	MarkEntry & entry = g_markLog[g_markIndex[slot]];
+	UnindexLogSlot(slot);
+	entry.block = nullptr;
+	entry.level = -1;
+	TrimLog();
+}
+
+/// Returns whether a block of specified level is free and not split
+/// Faster than IsFreeNode when the address is known
+bool IsBlockFree(Block * block, int level)
+{
+	return !IsSplit(MathBuddy::IndexGlobal(block, level))
+		&& !IsLeafTaken(MathBuddy::IndexWithinLevel(block, MAX_LEVELS - 1));
+}
+
+/// Removes blocks from the free list of specified level whose buddies were released
+/// The released blocks merge with them
+void DropReleasedBuddies(int level)
+{
+	Block * prev = nullptr;
+	Block * tmp = g_freeBlocks[level];
+	while (tmp)
+	{
+		Block * next = NextFree(tmp, level);
+		Block * buddy = MathBuddy::FindBuddy(tmp, level);
+		if (buddy && IsBlockFree(buddy, level))
+		{
+			// unlink
+			if (prev)
+				SetNextFree(prev, next, level);
+			else
+				g_freeBlocks[level] = next;
+		}
+		else
+			prev = tmp;
+		tmp = next;
+	}
+}
+
+/// Frees all blocks of the log entries at once
+/// Leafs of all blocks are freed first, then the blocks are merged level after level,
+/// so each free list is walked at most once and each entry is visited once per level it climbs
+/// Returns number of blocks freed
+int ReleaseBlocks(MarkEntry * entries, int count)
+{
+	// free leafs of all the blocks, chain the entries of each level into a list
+	int heads[MAX_LEVELS];
+	for (int level = 0; level < MAX_LEVELS; level++)
+		heads[level] = -1;
+	int released = 0;
+	for (int i = 0; i < count; i++)
+	{
+		if (!entries[i].block)
+			continue;
+		int leafIndex = MathBuddy::IndexWithinLevel(entries[i].block, MAX_LEVELS - 1);
+		MarkFree(leafIndex, MathBuddy::LevelToSize(entries[i].level) / MIN_SIZE);
+		MarkClean(MathBuddy::IndexGlobal(entries[i].block, entries[i].level), false);
+		entries[i].prevMark = heads[entries[i].level];
+		heads[entries[i].level] = i;
+		released++;
+	}
+
+	// merge from the bottom level up
+	for (int level = MAX_LEVELS - 1; level >= MAX_LEVELS - g_levelsNum; level--)
+	{
+		if (heads[level] < 0)
+			continue;
+		DropReleasedBuddies(level);
+
+		for (int i = heads[level], next; i >= 0; i = next)
+		{
+			next = entries[i].prevMark;
+			Block * block = entries[i].block;
+			Block * buddy = MathBuddy::FindBuddy(block, level);
+			if (buddy && IsBlockFree(buddy, level))
+			{
+				Block * merged = block < buddy ? block : buddy;
+				int index = MathBuddy::IndexGlobal(merged, level - 1);
+				if (!IsSplit(index))
+					// merged by its buddy already
+					continue;
+				MarkMerged(index);
+				MarkClean(index, false);
+				// continue on the upper level
+				entries[i].block = merged;
+				entries[i].prevMark = heads[level - 1];
+				heads[level - 1] = i;
+			}
+			else
+			{
+				// buddy is taken, the block stays
+				SetFreeSize(block, level);
+				AddFree(block, level);
+			}
+		}
+	}
+	return released;
+}
+
+// --------------------------------------------- REMOTE FREES ---------------------------------------------
+
+/*
+Blocks freed by a thread which doesn't own the heap are pushed to a lock-free stack
+The owner drains the whole stack at once, so pushing is the only concurrent operation
+Remote frees are validated only when the owner drains them, HeapFree from another thread
+reports success for any in-bounds pointer aligned to MIN_SIZE
+The link is stored into the block right away, so freeing a block which is not allocated from another
+thread (double free included) is undefined
+*/
+
+/// Returns whether the block is reserved for internal structures of the allocator
+bool IsInternalBlock(void * blk)
+{
+	return blk == g_metaStart || blk == g_freeNext || blk == g_markLog || blk == g_markIndex || blk == g_handles;
+}
+
+/// Returns whether the calling thread owns the heap
+bool IsHeapOwner()
+{
+	return this_thread::get_id() == g_owner;
+}
+
+/// Pushes a block freed by a non-owning thread to the remote stack
+void RemoteFree(void * blk)
+{
+	Block * block = (Block *)blk;
+	Block * head = g_remoteFrees.load(memory_order_relaxed);
+	do
+		block->next = head;
+	while (!g_remoteFrees.compare_exchange_weak(head, block, memory_order_release, memory_order_relaxed));
+	g_remoteCount.fetch_add(1, memory_order_relaxed);
+}
+
+/// Frees all blocks pushed by other threads, must be called by the owner
+void DrainRemoteFrees()
+{
+	Block * block = g_remoteFrees.exchange(nullptr, memory_order_acquire);
+	int drained = 0;
+	while (block)
+	{
+		// the header is rewritten by the free, keep the link first
+		Block * next = block->next;
+		if (!IsInternalBlock(block) && FreeBlock(block))
+		{
+			g_blocksPending--;
+			if (g_markTop >= 0)
+				UnlogAlloc(block);
+		}
+		block = next;
+		drained++;
+	}
+	g_remoteCount.fetch_sub(drained, memory_order_relaxed);
+}
+
+/// Drains the remote stack once enough blocks are waiting
+void DrainRemoteFreesIfFull()
+{
+	if (g_remoteCount.load(memory_order_relaxed) >= REMOTE_DRAIN_THRESHOLD && IsHeapOwner())
+		DrainRemoteFrees();
+}
+
 // --------------------------------------------- API ---------------------------------------------
 
+/// Flags of HeapInitEx
+enum HeapFlags
+{
+	/// the memory pool is filled with zeros (e.g. fresh mmap), lets HeapCalloc skip memset
+	HEAP_ZEROED = 1,
+	/// free list links of blocks >= 2^OOB_MIN_SIZE_LOG B are kept in a side table, alloc/free don't touch those blocks
+	HEAP_OUT_OF_BAND = 2,
+	/// HeapInitMapped only: back the pool by transparent huge pages
+	HEAP_HUGE_PAGES = 4,
+	/// HeapInitMapped only: back the pool by explicit huge pages (MAP_HUGETLB), falls back to HEAP_HUGE_PAGES
+	HEAP_HUGETLB = 8,
+};
+
 void HeapInit(void * memPool, int memSize);
+void HeapInitEx(void * memPool, int memSize, int flags);
 void * HeapAlloc(int size);
+void * HeapCalloc(int num, int size);
 bool HeapFree(void * blk);
 void HeapDone(int * pendingBlk);
 
 /// Initializes the heap with a memory block of given size
 void HeapInit(void * memPool, int memSize)
+{
+	HeapInitEx(memPool, memSize, 0);
+}
+
+/// Marks all free blocks as clean, the memory pool has to be zeroed
+void InitClean()
+{
+	// set all bits to 0 first (2 * leafs - 1 blocks)
+	MarkBits(g_metaCleanStart, 0, 2 * (g_buddySize / MIN_SIZE) - 1, false);
+	for (int level = MAX_LEVELS - g_levelsNum; level < MAX_LEVELS; level++)
+		for (Block * tmp = g_freeBlocks[level]; tmp; tmp = tmp->next)
+			MarkClean(MathBuddy::IndexGlobal(tmp, level), true);
+}
+
+/// Moves free list links of large blocks out of band, into a table allocated on the heap
+/// Headers of clean blocks are cleared, such blocks are then zeroed entirely
+void InitOutOfBand(bool zeroed)
+{
+	// one link for each block of the smallest out-of-band size
+	int size = (g_buddySize >> OOB_MIN_SIZE_LOG) * (int)sizeof(uint32_t);
+	uint32_t * table = (uint32_t *)BuddyAlloc(MathBuddy::SizeToLevel(size > MIN_SIZE ? size : MIN_SIZE));
+	if (!table)
+		return;
+	// copy links of the existing lists, nothing is out of band yet
+	for (int level = MAX_LEVELS - g_levelsNum; level <= MathBuddy::ExpToLevel(OOB_MIN_SIZE_LOG); level++)
+	{
+		Block * tmp = g_freeBlocks[level];
+		while (tmp)
+		{
+			Block * next = tmp->next;
+			uint32_t index = next ? (uint32_t)(((uint8_t *)next - (uint8_t *)g_buddyStart) >> OOB_MIN_SIZE_LOG) : OOB_NONE;
+			table[((uint8_t *)tmp - (uint8_t *)g_buddyStart) >> OOB_MIN_SIZE_LOG] = index;
+			if (zeroed)
+				memset((void *)tmp, 0, sizeof(Block));
+			tmp = next;
+		}
+	}
+	g_freeNext = table;
+}
+
+/// Initializes the heap with a memory block of given size using 'flags' (see HeapFlags)
+void HeapInitEx(void * memPool, int memSize, int flags)
 {
 	// clear memory first
 	ResetAllocator();
+	g_owner = this_thread::get_id();
+	if (g_mapStart && (memPool < g_mapStart || memPool >= (uint8_t *)g_mapStart + g_mapSize))
+		// pool mapped by HeapInitMapped is not used anymore
+		UnmapPool();
+	// cut memory which can't be covered even by the largest block
+	if (memSize > MAX_BUDDY_SIZE)
+		memSize = (int)MAX_BUDDY_SIZE;
 	// cut memory which can't be covered even by a min block 
 	g_memSize = (memSize >> MIN_SIZE_LOG) << MIN_SIZE_LOG;
 	g_memStart = memPool;
@@ -719,48 +1493,111 @@ void HeapInit(void * memPool, int memSize)
 	g_levelsNum = MathBuddy::LevelsNeeded(memSize);
 	InitBuddySystem();
 
-	// count metadata size 
-	g_metaSize = MathBuddy::Pow2Int(g_levelsNum - 3);  // needed: 2^levels b = 2^(levels-3) B 
+	// count metadata size: taken leafs + split nodes bitmaps
+	int bitmapSize = (g_buddySize / MIN_SIZE + 7) / 8;
+	g_metaSize = 2 * bitmapSize;
+	if (flags & HEAP_ZEROED)
+		// clean bitmap covers every block
+		g_metaSize += 2 * bitmapSize;
+	// the metadata is a buddy block itself
+	g_metaSize = g_metaSize > MIN_SIZE ? MathBuddy::Pow2Int(MathBuddy::Log2Int(g_metaSize)) : MIN_SIZE;
 	// allocate metadata space using the allocator
 	int index = MathBuddy::SizeToLevel(g_metaSize);
+	// find the block the metadata will be split from, splits can't be recorded before InitMeta
+	int splitFrom = index;
+	while (splitFrom > MAX_LEVELS - g_levelsNum && !g_freeBlocks[splitFrom])
+		splitFrom--;
 	g_metaStart = BuddyAlloc(index);
-	g_metaSplitStart = (void*)((uint8_t *)g_metaStart + g_metaSize / 2);
+	g_metaSplitStart = (void*)((uint8_t *)g_metaStart + bitmapSize);
 
 	InitMeta();
+	// record splits made while allocating the metadata
+	for (int level = splitFrom; level < index; level++)
+		MarkSplit(MathBuddy::IndexGlobal((Block *)g_metaStart, level));
+
+	if (flags & HEAP_ZEROED)
+	{
+		g_metaCleanStart = (void*)((uint8_t *)g_metaStart + 2 * bitmapSize);
+		InitClean();
+	}
+	if (flags & HEAP_OUT_OF_BAND)
+		InitOutOfBand(flags & HEAP_ZEROED);
 }
 
 /// Allocates memory block of 'size' bytes on the heap
 /// Returns pointer to the block
 void * HeapAlloc(int size)
 {
+	DrainRemoteFreesIfFull();
 	int index = MathBuddy::SizeToLevel(size);
 	Block * block = BuddyAlloc(index);
 
+	if (!block && g_remoteCount.load(memory_order_relaxed) && IsHeapOwner())
+	{
+		// blocks freed by other threads may be enough
+		DrainRemoteFrees();
+		block = BuddyAlloc(index);
+	}
 	if (!block)
 		return nullptr;
+	if (g_markTop >= 0 && LogAlloc(block, index) < 0)
+	{
+		// the block couldn't be released with the mark
+		FreeBlock(block);
+		return nullptr;
+	}
 
 	g_blocksPending++;
 	return (void *)block;
 }
 
+/// Allocates zeroed memory block for 'num' elements of 'size' bytes on the heap
+/// Blocks which are known to be clean only get their header zeroed
+/// Returns pointer to the block
+void * HeapCalloc(int num, int size)
+{
+	if (num < 0 || size < 0 || (size && num > INT_MAX / size))
+		// overflow
+		return nullptr;
+	int total = num * size;
+	void * block = HeapAlloc(total);
+	if (!block)
+		return nullptr;
+	int level = MathBuddy::SizeToLevel(total);
+	if (IsClean(MathBuddy::IndexGlobal((Block *)block, level)))
+		memset(block, 0, total < (int)sizeof(Block) ? total : sizeof(Block));
+	else
+		memset(block, 0, total);
+	return block;
+}
+
 /// Tries to free a memory block
-/// Returns success
+/// Returns success (always for aligned blocks freed by a thread which doesn't own the heap,
+/// freeing a block which is not allocated is undefined then)
 bool HeapFree(void * blk)
 {
 	if (blk < g_memStart || blk >= g_end)
 		// off bounds
 		return false;
-	if (blk == g_metaStart)
+	if (!IsHeapOwner())
+	{
+		if (((uint8_t *)blk - (uint8_t *)g_buddyStart) % MIN_SIZE != 0)
+			// cannot be a block, the link would overwrite used memory
+			return false;
+		// the owner validates and frees the block later, internal structures
+		// may be reallocated by the owner meanwhile
+		RemoteFree(blk);
+		return true;
+	}
+	if (IsInternalBlock(blk))
 		// block reserved for the metadata
 		return false;
+	DrainRemoteFreesIfFull();
 	// try to free
-	if (!TryFreeBlock(blk))
+	if (!FreeBlock(blk))
 		return false;
-	// merge new block
-	Block* merged = Merge((Block *)blk);
-	// add it to corresponding list
-	int level = MathBuddy::SizeToLevel(merged->size);
-	AddFree(merged, level);
+	if (g_markTop >= 0)
+		UnlogAlloc(blk);
 
 	g_blocksPending--;
 	return true;
@@ -769,9 +1606,327 @@ bool HeapFree(void * blk)
 /// Returns number of blocks allocated in the memory 
 void HeapDone(int * pendingBlk)
 {
+	if (IsHeapOwner())
+		DrainRemoteFrees();
 	*pendingBlk = g_blocksPending;
 }
 
+// --------------------------------------------- MAPPED POOL ---------------------------------------------
+
+#ifdef __linux__
+
+/*
+The heap maps its own pool aligned to huge pages, the end of the pool (and so the buddy origin) is aligned too
+Every block of 2MiB and more then starts on a huge page boundary and smaller blocks (metadata included)
+never straddle one
+*/
+
+bool HeapInitMapped(int size, int flags);
+
+/// Returns whether transparent huge pages may back memory advised by MADV_HUGEPAGE
+/// madvise succeeds even when they are turned off
+bool IsThpEnabled()
+{
+	FILE * file = fopen("/sys/kernel/mm/transparent_hugepage/enabled", "r");
+	if (!file)
+		return false;
+	char mode[64] = {};
+	bool enabled = fgets(mode, sizeof(mode), file) && (strstr(mode, "[always]") || strstr(mode, "[madvise]"));
+	fclose(file);
+	return enabled;
+}
+
+/// Maps 'size' bytes aligned to HUGE_PAGE_SIZE, tries huge pages according to 'flags'
+/// Stores the page flags the memory got into 'mapFlags'
+/// Returns nullptr on failure
+void * MapPool(size_t size, int flags, int * mapFlags)
+{
+#ifdef MAP_HUGETLB
+	if (flags & HEAP_HUGETLB)
+	{
+		// explicit huge pages are aligned by the kernel, no MAP_NORESERVE: the pages have to be
+		// reserved now, touching an unbacked page later would raise SIGBUS
+		void * pool = mmap(nullptr, size, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+		if (pool != MAP_FAILED)
+		{
+			*mapFlags = HEAP_HUGETLB;
+			return pool;
+		}
+		flags |= HEAP_HUGE_PAGES;
+	}
+#endif
+	// reserve one huge page more, trim the unaligned parts
+	uint8_t * area = (uint8_t *)mmap(nullptr, size + HUGE_PAGE_SIZE, PROT_READ | PROT_WRITE,
+		MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	if (area == MAP_FAILED)
+		return nullptr;
+	uint8_t * pool = (uint8_t *)(((uintptr_t)area + HUGE_PAGE_SIZE - 1) & ~((uintptr_t)HUGE_PAGE_SIZE - 1));
+	size_t head = pool - area;
+	if (head)
+		munmap(area, head);
+	munmap(pool + size, HUGE_PAGE_SIZE - head);
+	*mapFlags = 0;
+#ifdef MADV_HUGEPAGE
+	if ((flags & HEAP_HUGE_PAGES) && !madvise(pool, size, MADV_HUGEPAGE) && IsThpEnabled())
+		*mapFlags = HEAP_HUGE_PAGES;
+#endif
+	return pool;
+}
+
+/// Initializes the heap with its own memory pool of at least 'size' bytes, aligned to huge pages
+/// Accepts HEAP_HUGE_PAGES / HEAP_HUGETLB besides the HeapInitEx flags, the pool is always zeroed
+/// The pool is unmapped by the next initialization, the current heap stays untouched on failure
+/// Returns success
+bool HeapInitMapped(int size, int flags)
+{
+	// whole huge pages only
+	long long memSize = ((long long)size + HUGE_PAGE_SIZE - 1) / HUGE_PAGE_SIZE * HUGE_PAGE_SIZE;
+	if (memSize <= 0 || memSize > MAX_BUDDY_SIZE)
+		return false;
+	int mapFlags;
+	void * pool = MapPool((size_t)memSize, flags, &mapFlags);
+	if (!pool)
+		return false;
+	// the previous mapping is released here
+	HeapInitEx(pool, (int)memSize, (flags & HEAP_OUT_OF_BAND) | HEAP_ZEROED);
+	g_mapStart = pool;
+	g_mapSize = (size_t)memSize;
+	g_mapFlags = mapFlags;
+	return true;
+}
+
+#endif /* __linux__ */
+
+// --------------------------------------------- HANDLES ---------------------------------------------
+
+/*
+Handle allocations are referenced through the handle table instead of a raw pointer
+The block is pinned only while it is being used, unpinned blocks may be moved by HeapCompact
+*/
+
+int HeapAllocHandle(int size);
+void * HeapPin(int handle);
+void HeapUnpin(int handle);
+bool HeapFreeHandle(int handle);
+int HeapCompact(int byteBudget);
+
+/// Returns whether 'handle' refers to a used entry of the handle table
+bool IsHandleValid(int handle)
+{
+	return handle >= 0 && handle < g_handlesCap && g_handles[handle].addr;
+}
+
+/// Doubles the capacity of the handle table
+/// Returns success
+bool GrowHandles()
+{
+	int cap = g_handlesCap ? g_handlesCap * 2 : 16;
+	HandleEntry * table = (HandleEntry *)InternalRealloc(g_handles,
+		g_handlesCap * (int)sizeof(HandleEntry), cap * (int)sizeof(HandleEntry));
+	if (!table)
+		return false;
+	// chain new entries into the list of unused ones
+	for (int i = g_handlesCap; i < cap; i++)
+	{
+		table[i].addr = nullptr;
+		table[i].pins = 0;
+		table[i].nextFree = i + 1 < cap ? i + 1 : g_handlesFree;
+	}
+	g_handlesFree = g_handlesCap;
+	g_handles = table;
+	g_handlesCap = cap;
+	return true;
+}
+
+/// Frees the handle table once no handle is used, so it doesn't pin a block of the heap
+void FreeHandlesIfUnused()
+{
+	if (g_handlesUsed || !g_handles)
+		return;
+	FreeBlock(g_handles);
+	g_handles = nullptr;
+	g_handlesCap = 0;
+	g_handlesFree = -1;
+	g_compactCursor = 0;
+}
+
+/// Picks a free block on specified level which the block 'avoid' may be moved to
+/// Prefers holes next to taken blocks so their parents become fully used
+Block * FindCompactTarget(int level, Block * avoid)
+{
+	Block * fallback = nullptr;
+	for (Block * tmp = g_freeBlocks[level]; tmp; tmp = NextFree(tmp, level))
+	{
+		if (tmp == avoid)
+			continue;
+		Block * buddy = MathBuddy::FindBuddy(tmp, level);
+		int index = buddy ? MathBuddy::IndexGlobal(buddy, level) : -1;
+		if (buddy && !IsSplit(index) && IsTaken(index))
+			return tmp;
+		if (!fallback)
+			fallback = tmp;
+	}
+	return fallback;
+}
+
+/// Moves block of a handle out of a subtree its buddy left free
+/// Returns number of bytes moved (0 when the block stays)
+int CompactHandle(HandleEntry & entry)
+{
+	int index;
+	int size = FindBlockSize(entry.addr, &index);
+	int level = MathBuddy::SizeToLevel(size);
+	// the block only pins its parent when the buddy is free
+	Block * buddy = MathBuddy::FindBuddy((Block *)entry.addr, level);
+	if (!buddy || !IsFreeNode(MathBuddy::IndexGlobal(buddy, level)))
+		return 0;
+	Block * target = FindCompactTarget(level, buddy);
+	if (!target)
+		return 0;
+	// take the target block and copy the data
+	RemoveFree(target, level);
+	MarkAlloc(target, level);
+	memcpy(target, entry.addr, size);
+	// release the original block so it can merge with its buddy
+	FreeBlock(entry.addr);
+	entry.addr = target;
+	return size;
+}
+
+/// Allocates relocatable memory block of 'size' bytes on the heap
+/// Returns handle of the block, -1 when there is not enough space
+int HeapAllocHandle(int size)
+{
+	if (g_handlesFree == -1 && !GrowHandles())
+		return -1;
+	Block * block = BuddyAlloc(MathBuddy::SizeToLevel(size));
+	if (!block)
+	{
+		FreeHandlesIfUnused();
+		return -1;
+	}
+	// take first unused entry
+	int handle = g_handlesFree;
+	g_handlesFree = g_handles[handle].nextFree;
+	g_handles[handle].addr = block;
+	g_handles[handle].pins = 0;
+	g_handlesUsed++;
+
+	g_blocksPending++;
+	return handle;
+}
+
+/// Pins block of a handle so it can't be moved
+/// Returns current address of the block, nullptr for an invalid handle
+void * HeapPin(int handle)
+{
+	if (!IsHandleValid(handle))
+		return nullptr;
+	g_handles[handle].pins++;
+	return g_handles[handle].addr;
+}
+
+/// Releases one pin of a handle, the block may be moved once it is not pinned
+void HeapUnpin(int handle)
+{
+	if (IsHandleValid(handle) && g_handles[handle].pins > 0)
+		g_handles[handle].pins--;
+}
+
+/// Tries to free block of a handle, pinned blocks can't be freed
+/// Returns success
+bool HeapFreeHandle(int handle)
+{
+	if (!IsHandleValid(handle) || g_handles[handle].pins > 0)
+		return false;
+	if (!FreeBlock(g_handles[handle].addr))
+		return false;
+	// return the entry to the unused ones
+	g_handles[handle].addr = nullptr;
+	g_handles[handle].nextFree = g_handlesFree;
+	g_handlesFree = handle;
+	g_handlesUsed--;
+	FreeHandlesIfUnused();
+
+	g_blocksPending--;
+	return true;
+}
+
+/// Runs incremental compaction, moves unpinned blocks until 'byteBudget' bytes are copied
+/// Every pass continues where the previous one stopped
+/// Returns number of bytes moved
+int HeapCompact(int byteBudget)
+{
+	int moved = 0;
+	for (int i = 0; i < g_handlesCap && moved < byteBudget; i++)
+	{
+		HandleEntry & entry = g_handles[g_compactCursor];
+		if (entry.addr && !entry.pins)
+			moved += CompactHandle(entry);
+		g_compactCursor = (g_compactCursor + 1) % g_handlesCap;
+	}
+	return moved;
+}
+
+// --------------------------------------------- MARKS ---------------------------------------------
+
+/*
+Blocks allocated by HeapAlloc after HeapMark are logged, HeapRelease frees all of them in one pass
+Marks are logged too, each one links the previous active mark, so the log is never trimmed below
+the last one and releasing a mark releases the marks made after it, handle allocations are not affected
+*/
+
+int HeapMark();
+bool HeapRelease(int mark);
+
+/// Marks current state of the heap
+/// Returns the mark for HeapRelease, -1 when there is no space for the log
+int HeapMark()
+{
+	int mark = LogAlloc(nullptr, MARK_LEVEL);
+	if (mark < 0)
+	{
+		FreeLogIfUnused();
+		return -1;
+	}
+	g_markLog[mark].prevMark = g_markTop;
+	g_markTop = mark;
+	return mark;
+}
+
+/// Frees all blocks allocated by HeapAlloc after the mark was made (and not freed yet)
+/// Marks made after it are released too
+/// Returns success
+bool HeapRelease(int mark)
+{
+	if (mark < 0 || mark > g_markTop)
+		return false;
+	// the mark has to be active
+	int active = g_markTop;
+	while (active > mark)
+		active = g_markLog[active].prevMark;
+	if (active != mark)
+		return false;
+	// queued blocks can't be freed twice
+	if (IsHeapOwner())
+		DrainRemoteFrees();
+	if (g_markLog[mark].prevMark >= 0)
+		// the table stays in use
+		for (int i = mark + 1; i < g_markIndexed; i++)
+			if (g_markLog[i].block)
+				UnindexLogSlot(FindLogSlot(g_markLog[i].block));
+	if (g_markIndexed > mark)
+		g_markIndexed = mark;
+	g_blocksPending -= ReleaseBlocks(g_markLog + mark + 1, g_markLogSize - mark - 1);
+	g_markTop = g_markLog[mark].prevMark;
+	g_markLogSize = mark;
+	TrimLog();
+	// nothing to log anymore
+	FreeLogIfUnused();
+	return true;
+}
+
 // --------------------------------------------- TESTING ---------------------------------------------
 
 #ifndef __PROGTEST__
@@ -845,9 +2000,630 @@ void TestRef()
 	assert(pendingBlk == 1);
 }
 
-int main(void)
+void TestHandles()
 {
+	int handles[16];
+	int pendingBlk;
+	static uint8_t memPool[1048576];
+
+	// fragment the heap, every 128 KiB block keeps one 64 KiB handle
+	HeapInit(memPool, 1048576);
+	for (int i = 0; i < 15; i++)
+	{
+		assert((handles[i] = HeapAllocHandle(65536)) != -1);
+		uint8_t * p = (uint8_t *)HeapPin(handles[i]);
+		memset(p, i, 65536);
+		HeapUnpin(handles[i]);
+	}
+	assert(HeapAllocHandle(65536) == -1);
+	for (int i = 0; i < 15; i++)
+	{
+		uint8_t * p = (uint8_t *)HeapPin(handles[i]);
+		HeapUnpin(handles[i]);
+		if ((int)(p - memPool) / 65536 % 2 == 0)
+		{
+			assert(HeapFreeHandle(handles[i]));
+			handles[i] = -1;
+		}
+	}
+	assert(HeapAlloc(100000) == NULL);
+
+	// pinned blocks stay in place
+	int pinned = handles[1] != -1 ? handles[1] : handles[0];
+	uint8_t * pinnedAddr = (uint8_t *)HeapPin(pinned);
+	assert(!HeapFreeHandle(pinned));
+	// the handle table is internal
+	assert(!HeapFree(g_handles));
+
+	// compact incrementally, one block per call
+	int moved = 0, passes = 0;
+	while ((moved = HeapCompact(1)) > 0)
+		passes++;
+	assert(passes > 0);
+	assert(HeapPin(pinned) == pinnedAddr);
+	HeapUnpin(pinned);
+	HeapUnpin(pinned);
+	assert(HeapAlloc(100000) != NULL);
+
+	// data moved together with the blocks
+	for (int i = 0; i < 15; i++)
+	{
+		if (handles[i] == -1)
+			continue;
+		uint8_t * p = (uint8_t *)HeapPin(handles[i]);
+		for (int j = 0; j < 65536; j += 4096)
+			assert(p[j] == i);
+		HeapUnpin(handles[i]);
+		assert(HeapFreeHandle(handles[i]));
+	}
+	HeapDone(&pendingBlk);
+	assert(pendingBlk == 1);
+
+	// the handle table goes away with the last handle
+	static uint8_t bitmaps[2][16384];
+	HeapInit(memPool, 1048576);
+	int bitmapSize = 2 * ((g_buddySize / MIN_SIZE + 7) / 8);
+	assert(bitmapSize <= (int)sizeof(bitmaps[0]));
+	memcpy(bitmaps[0], g_metaStart, bitmapSize);
+	for (int i = 0; i < 16; i++)
+		assert((handles[i] = HeapAllocHandle(1000)) != -1);
+	for (int i = 0; i < 16; i++)
+		assert(HeapFreeHandle(handles[i]));
+	assert(!g_handles && !HeapPin(handles[0]));
+	memcpy(bitmaps[1], g_metaStart, bitmapSize);
+	assert(!memcmp(bitmaps[0], bitmaps[1], bitmapSize));
+	assert(HeapAllocHandle(2000000) == -1);
+	assert(!g_handles);
+}
+
+void TestRemoteFree()
+{
+	uint8_t * blocks[200];
+	int pendingBlk;
+	static uint8_t memPool[1048576];
+
+	// blocks allocated by the owner, freed by two other threads
+	HeapInit(memPool, 1048576);
+	for (int i = 0; i < 200; i++)
+		assert((blocks[i] = (uint8_t *)HeapAlloc(1000)) != NULL);
+	thread first([&blocks]() { for (int i = 0; i < 100; i++) assert(HeapFree(blocks[i])); });
+	thread second([&blocks]() { for (int i = 100; i < 200; i++) assert(HeapFree(blocks[i])); });
+	first.join();
+	second.join();
+	// nothing is freed until the owner drains the queue
+	assert(g_remoteCount.load() == 200);
+	assert(HeapAlloc(1000) != NULL);
+	assert(g_remoteCount.load() == 0);
+	HeapDone(&pendingBlk);
+	assert(pendingBlk == 1);
+
+	// owner drains the queue when it runs out of memory
+	HeapInit(memPool, 1048576);
+	assert((blocks[0] = (uint8_t *)HeapAlloc(500000)) != NULL);
+	thread third([&blocks]() { assert(HeapFree(blocks[0])); });
+	third.join();
+	assert(HeapAlloc(500000) != NULL);
+	HeapDone(&pendingBlk);
+	assert(pendingBlk == 1);
+
+	// misaligned remote frees are rejected before the link is stored
+	HeapInit(memPool, 1048576);
+	assert((blocks[0] = (uint8_t *)HeapAlloc(4096)) != NULL);
+	memset(blocks[0], 0xaa, 4096);
+	thread fourth([&blocks]() { assert(!HeapFree(blocks[0] + 1000)); });
+	fourth.join();
+	for (int i = 0; i < 4096; i++)
+		assert(blocks[0][i] == 0xaa);
+	assert(g_remoteCount.load() == 0);
+	assert(HeapFree(blocks[0]));
+
+	// a consumer frees blocks while the owner keeps logging them under a mark
+	static uint8_t * published[150];
+	atomic<int> publishedNum(0);
+	int mark = HeapMark();
+	thread consumer([&publishedNum]()
+	{
+		for (int i = 0; i < 150; i++)
+		{
+			while (publishedNum.load(memory_order_acquire) <= i)
+				this_thread::yield();
+			assert(HeapFree(published[i]));
+		}
+	});
+	for (int i = 0; i < 150; i++)
+	{
+		assert((published[i] = (uint8_t *)HeapAlloc(100)) != NULL);
+		publishedNum.store(i + 1, memory_order_release);
+	}
+	consumer.join();
+	HeapDone(&pendingBlk);
+	assert(pendingBlk == 0);
+	assert(HeapRelease(mark));
+	assert((blocks[0] = (uint8_t *)HeapAlloc(500000)) != NULL);
+	HeapDone(&pendingBlk);
+	assert(pendingBlk == 1);
+}
+
+void TestCalloc()
+{
+	uint8_t * p0, *p1;
+	int pendingBlk;
+	static uint8_t memPool[1048576];
+
+	// fresh zeroed memory, blocks are clean
+	HeapInitEx(memPool, 1048576, HEAP_ZEROED);
+	assert((p0 = (uint8_t*)HeapCalloc(1, 300000)) != NULL);
+	assert(IsClean(MathBuddy::IndexGlobal((Block *)p0, MathBuddy::SizeToLevel(300000))));
+	for (int i = 0; i < 300000; i++)
+		assert(p0[i] == 0);
+	assert((p1 = (uint8_t*)HeapCalloc(1000, 100)) != NULL);
+	for (int i = 0; i < 100000; i++)
+		assert(p1[i] == 0);
+
+	// freed blocks are dirty
+	memset(p0, 0xab, 300000);
+	assert(HeapFree(p0));
+	assert((p0 = (uint8_t*)HeapCalloc(3000, 100)) != NULL);
+	for (int i = 0; i < 300000; i++)
+		assert(p0[i] == 0);
+	assert(HeapCalloc(INT_MAX, 2) == NULL);
+	assert(HeapFree(p0));
+	assert(HeapFree(p1));
+	HeapDone(&pendingBlk);
+	assert(pendingBlk == 0);
+
+	// no zeroed memory promised, everything is cleared
+	memset(memPool, 0xcd, sizeof(memPool));
+	HeapInit(memPool, 1048576);
+	assert((p0 = (uint8_t*)HeapCalloc(1, 300000)) != NULL);
+	for (int i = 0; i < 300000; i++)
+		assert(p0[i] == 0);
+	HeapDone(&pendingBlk);
+	assert(pendingBlk == 1);
+}
+
+void TestMarkRelease(int flags)
+{
+	uint8_t * p0, *p1, *blocks[300];
+	int pendingBlk;
+	static uint8_t memPool[2097152];
+	static uint8_t bitmaps[2][65536];
+
+	HeapInitEx(memPool, 2000000, flags);
+	int bitmapSize = 2 * ((g_buddySize / MIN_SIZE + 7) / 8);
+	assert(bitmapSize <= (int)sizeof(bitmaps[0]));
+	assert((p0 = (uint8_t*)HeapAlloc(100000)) != NULL);
+	memcpy(bitmaps[0], g_metaStart, bitmapSize);
+
+	// everything allocated after the mark is released at once
+	int mark = HeapMark();
+	unsigned seed = 42;
+	for (int i = 0; i < 300; i++)
+	{
+		seed = seed * 1103515245 + 12345;
+		assert((blocks[i] = (uint8_t *)HeapAlloc(16 + (seed >> 16) % 3000)) != NULL);
+	}
+	// some of them are freed by hand
+	for (int i = 0; i < 300; i += 7)
+		assert(HeapFree(blocks[i]));
+	// nested mark
+	int inner = HeapMark();
+	assert((p1 = (uint8_t*)HeapAlloc(200000)) != NULL);
+	assert(HeapRelease(inner));
+	assert(!HeapFree(p1));
+	HeapDone(&pendingBlk);
+	assert(pendingBlk == 1 + 300 - 43);
+	assert(HeapRelease(mark));
+	assert(!HeapRelease(mark));
+	HeapDone(&pendingBlk);
+	assert(pendingBlk == 1);
+
+	// the tree looks the same as before the mark
+	memcpy(bitmaps[1], g_metaStart, bitmapSize);
+	assert(!memcmp(bitmaps[0], bitmaps[1], bitmapSize));
+	assert(HeapFree(p0));
+	assert((p0 = (uint8_t*)HeapAlloc(1000000)) != NULL);
+	assert((p1 = (uint8_t*)HeapAlloc(500000)) != NULL);
+	HeapDone(&pendingBlk);
+	assert(pendingBlk == 2);
+
+	// blocks freed by hand across the boundary of a nested mark
+	HeapInitEx(memPool, 2000000, flags);
+	int outer = HeapMark();
+	assert((p0 = (uint8_t*)HeapAlloc(100)) != NULL);
+	inner = HeapMark();
+	assert(HeapFree(p0));
+	assert((p1 = (uint8_t*)HeapAlloc(100)) != NULL);
+	assert(HeapRelease(inner));
+	assert(!HeapFree(p1));
+	HeapDone(&pendingBlk);
+	assert(pendingBlk == 0);
+	assert((p0 = (uint8_t*)HeapAlloc(100)) != NULL);
+	inner = HeapMark();
+	assert(HeapFree(p0));
+	assert(HeapRelease(inner));
+	assert(!HeapRelease(inner));
+	assert(HeapRelease(outer));
+	assert(!g_markLog && !g_markIndex);
+
+	// releasing an outer mark releases the inner ones
+	outer = HeapMark();
+	for (int i = 0; i < 300; i++)
+	{
+		assert((blocks[i] = (uint8_t *)HeapAlloc(100 + i)) != NULL);
+		if (i % 100 == 0)
+			HeapMark();
+	}
+	// freed in the allocation order, the log entries are found through the table
+	for (int i = 0; i < 300; i += 2)
+		assert(HeapFree(blocks[i]));
+	assert(!HeapFree(g_markIndex));
+	HeapDone(&pendingBlk);
+	assert(pendingBlk == 150);
+	assert(HeapRelease(outer));
+	assert(!g_markLog && !g_markIndex);
+	HeapDone(&pendingBlk);
+	assert(pendingBlk == 0);
+	assert((p0 = (uint8_t*)HeapAlloc(1000000)) != NULL);
+	assert(HeapFree(p0));
+}
+
+#ifdef __linux__
+void TestMapped()
+{
+	uint8_t * p0, *p1;
+	int pendingBlk;
+	static uint8_t memPool[1048576];
+
+	// pool and buddy origin are aligned to huge pages (whatever pages the host provides)
+	assert(HeapInitMapped(10 * 1048576, HEAP_HUGETLB));
+	assert(g_mapStart);
+	printf("mapped pool pages: %s\n", g_mapFlags == HEAP_HUGETLB ? "hugetlb"
+		: g_mapFlags == HEAP_HUGE_PAGES ? "THP" : "4 KiB");
+	assert((uintptr_t)g_buddyStart % HUGE_PAGE_SIZE == 0);
+	assert((uintptr_t)g_metaStart % g_metaSize == 0);
+	assert((p0 = (uint8_t*)HeapAlloc(HUGE_PAGE_SIZE)) != NULL);
+	assert((uintptr_t)p0 % HUGE_PAGE_SIZE == 0);
+	// mapped memory is zeroed
+	assert((p1 = (uint8_t*)HeapCalloc(1, 3000000)) != NULL);
+	for (int i = 0; i < 3000000; i += 512)
+		assert(p1[i] == 0);
+	HeapDone(&pendingBlk);
+	assert(pendingBlk == 2);
+
+	// plain pool, no huge pages asked
+	assert(HeapInitMapped(3 * 1048576, HEAP_OUT_OF_BAND));
+	assert(g_mapFlags == 0 && g_freeNext);
+	assert((p0 = (uint8_t*)HeapAlloc(1000000)) != NULL);
+	assert(HeapFree(p0));
+
+	// failures leave the current heap untouched
+	assert((p0 = (uint8_t*)HeapAlloc(1000)) != NULL);
+	assert(!HeapInitMapped(0, 0));
+	assert(!HeapInitMapped(INT_MAX, 0));
+	assert(!HeapInitMapped(1536 * 1048576, 0));
+	assert(g_mapStart);
+	memset(p0, 1, 1000);
+	assert((p1 = (uint8_t*)HeapAlloc(100)) != NULL);
+	assert(HeapFree(p0) && HeapFree(p1));
+	HeapDone(&pendingBlk);
+	assert(pendingBlk == 0);
+
+	// the mapping is released by the next initialization
+	HeapInit(memPool, 1048576);
+	assert(!g_mapStart);
+	assert(!HeapInitMapped(0, 0));
+	assert(HeapAlloc(100) != NULL);
+}
+#endif /* __linux__ */
+
+/// Runs random allocations and frees, frees everything at the end
+void RandomChurn(int ops)
+{
+	uint8_t * blocks[64] = {};
+	unsigned seed = 12345;
+	for (int i = 0; i < ops; i++)
+	{
+		seed = seed * 1103515245 + 12345;
+		int slot = (seed >> 8) % 64;
+		if (blocks[slot])
+			assert(HeapFree(blocks[slot]));
+		blocks[slot] = (uint8_t *)HeapAlloc(16 + (seed >> 16) % 20000);
+	}
+	for (int i = 0; i < 64; i++)
+		if (blocks[i])
+			assert(HeapFree(blocks[i]));
+}
+
+void TestOutOfBand()
+{
+	uint8_t * p0, *p1;
+	int pendingBlk;
+	static uint8_t memPool[2097152];
+
+	// freeing and merging large blocks doesn't write into them
+	HeapInitEx(memPool, 2000000, HEAP_OUT_OF_BAND);
+	assert((p0 = (uint8_t*)HeapAlloc(4096)) != NULL);
+	assert((p1 = (uint8_t*)HeapAlloc(4096)) != NULL);
+	memset(p0, 0xab, 4096);
+	memset(p1, 0xab, 4096);
+	assert(HeapFree(p1));
+	assert(HeapFree(p0));
+	for (int i = 0; i < 4096; i++)
+		assert(p0[i] == 0xab && p1[i] == 0xab);
+	HeapDone(&pendingBlk);
+	assert(pendingBlk == 0);
+
+	// random allocations, whole memory is merged back at the end
+	RandomChurn(5000);
+	HeapDone(&pendingBlk);
+	assert(pendingBlk == 0);
+	assert((p0 = (uint8_t*)HeapAlloc(1000000)) != NULL);
+	assert(HeapFree(p0));
+
+	// zeroed memory stays tracked
+	memset(memPool, 0, sizeof(memPool));
+	HeapInitEx(memPool, 2000000, HEAP_OUT_OF_BAND | HEAP_ZEROED);
+	assert((p0 = (uint8_t*)HeapCalloc(1, 100000)) != NULL);
+	for (int i = 0; i < 100000; i++)
+		assert(p0[i] == 0);
+	HeapDone(&pendingBlk);
+	assert(pendingBlk == 1);
+}
+
+// --------------------------------------------- BENCHMARKS ---------------------------------------------
+
+/// Opens a counter of cache misses of the calling thread
+/// Returns -1 when hardware counters are not available
+int BenchOpenCounter()
+{
+#ifdef __linux__
+	perf_event_attr attr;
+	memset(&attr, 0, sizeof(attr));
+	attr.type = PERF_TYPE_HARDWARE;
+	attr.size = sizeof(attr);
+	attr.config = PERF_COUNT_HW_CACHE_MISSES;
+	attr.exclude_kernel = 1;
+	attr.exclude_hv = 1;
+	return (int)syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+#else
+	return -1;
+#endif
+}
+
+/// Reads value of a counter opened by BenchOpenCounter, -1 when not available
+long long BenchReadCounter(int fd)
+{
+	long long value = -1;
+#ifdef __linux__
+	if (fd < 0 || read(fd, &value, sizeof(value)) != sizeof(value))
+		return -1;
+#endif
+	return value;
+}
+
+/// Closes a counter opened by BenchOpenCounter
+void BenchCloseCounter(int fd)
+{
+#ifdef __linux__
+	if (fd >= 0)
+		close(fd);
+#endif
+}
+
+/// Returns time in nanoseconds
+double BenchNow()
+{
+	return (double)chrono::duration_cast<chrono::nanoseconds>(
+		chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+/// Simple xorshift generator for benchmarks
+uint32_t BenchRandom(uint32_t & state)
+{
+	state ^= state << 13;
+	state ^= state >> 17;
+	state ^= state << 5;
+	return state;
+}
+
+/// Random alloc/free churn over a large working set of blocks which are never touched by the user
+/// Compares free lists stored in the blocks with the out-of-band ones
+void BenchFreeLists()
+{
+	const int poolSize = 256 * 1048576;
+	const int slots = 8192;
+	const int ops = 2000000;
+	static void * blocks[slots];
+
+	printf("free lists: %d MiB pool, %d live blocks of 1-32 KiB, %d alloc/free pairs\n", poolSize >> 20, slots, ops);
+	const char * names[2] = { "in band", "out of band" };
+	int flags[2] = { 0, HEAP_OUT_OF_BAND };
+	for (int mode = 0; mode < 2; mode++)
+	{
+		// fresh memory, pages are faulted in only when touched
+		uint8_t * memPool = (uint8_t *)malloc(poolSize);
+		HeapInitEx(memPool, poolSize, flags[mode]);
+		uint32_t state = 2463534242u;
+		for (int i = 0; i < slots; i++)
+			blocks[i] = HeapAlloc(1024 + BenchRandom(state) % 31744);
+
+		int counter = BenchOpenCounter();
+		long long missesStart = BenchReadCounter(counter);
+		double start = BenchNow();
+		for (int i = 0; i < ops; i++)
+		{
+			int slot = BenchRandom(state) % slots;
+			if (blocks[slot])
+				HeapFree(blocks[slot]);
+			blocks[slot] = HeapAlloc(1024 + BenchRandom(state) % 31744);
+		}
+		double time = BenchNow() - start;
+		long long misses = BenchReadCounter(counter);
+		BenchCloseCounter(counter);
+
+		printf("  %-12s %7.1f ns/op", names[mode], time / ops);
+		if (missesStart >= 0 && misses >= 0)
+			printf(", %6.2f cache misses/op", (double)(misses - missesStart) / ops);
+		else
+			printf(", cache misses n/a");
+		printf("\n");
+		free(memPool);
+	}
+}
+
+/// Metadata size and alloc/free speed of the compiled geometry (see BUDDY_MIN_SIZE_LOG, BUDDY_MAX_LEVELS)
+/// Build with different geometries to compare them
+void BenchGeometry()
+{
+	const int poolSize = 256 * 1048576;
+	const int slots = 4096;
+	const int ops = 2000000;
+	static void * blocks[slots];
+
+	uint8_t * memPool = (uint8_t *)malloc(poolSize);
+	HeapInit(memPool, poolSize);
+	printf("geometry: %d B leafs, %d levels max, %d MiB pool\n", MIN_SIZE, MAX_LEVELS, poolSize >> 20);
+	printf("  metadata %d B (%.3f %% of the pool), %d levels used\n",
+		g_metaSize, 100.0 * g_metaSize / poolSize, g_levelsNum);
+
+	// page sized requests
+	uint32_t state = 2463534242u;
+	for (int i = 0; i < slots; i++)
+		blocks[i] = HeapAlloc(4096 << (BenchRandom(state) % 5));
+	double start = BenchNow();
+	for (int i = 0; i < ops; i++)
+	{
+		int slot = BenchRandom(state) % slots;
+		if (blocks[slot])
+			HeapFree(blocks[slot]);
+		blocks[slot] = HeapAlloc(4096 << (BenchRandom(state) % 5));
+	}
+	double time = BenchNow() - start;
+	printf("  4-64 KiB alloc/free pairs: %.1f ns/op\n", time / ops);
+	free(memPool);
+}
+
+/// Request-like workload, hundreds of small blocks freed together
+/// Compares HeapFree of every block with one HeapRelease
+void BenchRelease()
+{
+	const int poolSize = 64 * 1048576;
+	const int blocksNum = 500;
+	const int rounds = 2000;
+	static void * blocks[blocksNum];
+
+	uint8_t * memPool = (uint8_t *)malloc(poolSize);
+	printf("release: %d rounds of %d blocks of 16-2048 B\n", rounds, blocksNum);
+	const char * names[2] = { "HeapFree", "HeapRelease" };
+	for (int mode = 0; mode < 2; mode++)
+	{
+		HeapInit(memPool, poolSize);
+		// long-lived data
+		uint32_t state = 2463534242u;
+		for (int i = 0; i < 1000; i++)
+			HeapAlloc(16 + BenchRandom(state) % 2032);
+
+		double allocTime = 0, freeTime = 0;
+		for (int round = 0; round < rounds; round++)
+		{
+			double start = BenchNow();
+			int mark = mode ? HeapMark() : 0;
+			for (int i = 0; i < blocksNum; i++)
+				blocks[i] = HeapAlloc(16 + BenchRandom(state) % 2032);
+			double middle = BenchNow();
+			if (mode)
+				HeapRelease(mark);
+			else
+				for (int i = 0; i < blocksNum; i++)
+					HeapFree(blocks[i]);
+			double end = BenchNow();
+			allocTime += middle - start;
+			freeTime += end - middle;
+		}
+		printf("  %-12s alloc %6.1f ns/block, free %6.1f ns/block, total %6.1f ns/block\n", names[mode],
+			allocTime / rounds / blocksNum, freeTime / rounds / blocksNum,
+			(allocTime + freeTime) / rounds / blocksNum);
+	}
+	free(memPool);
+}
+
+#ifdef __linux__
+/// Random reads over buffers allocated from a mapped pool, with and without huge pages
+void BenchHugePages()
+{
+	const int poolSize = 512 * 1048576;
+	const int buffersNum = 1024;
+	const int reads = 20000000;
+	static uint8_t * buffers[buffersNum];
+	static int sizes[buffersNum];
+
+	printf("huge pages: %d MiB pool, %d buffers of 64-512 KiB, %d random reads\n", poolSize >> 20, buffersNum, reads);
+	const char * names[3] = { "4 KiB pages", "THP", "hugetlb" };
+	int flags[3] = { 0, HEAP_HUGE_PAGES, HEAP_HUGETLB };
+	for (int mode = 0; mode < 3; mode++)
+	{
+		if (!HeapInitMapped(poolSize, flags[mode]))
+			continue;
+		if (g_mapFlags != flags[mode])
+		{
+			printf("  %-12s not available\n", names[mode]);
+			continue;
+		}
+		// allocate and touch the buffers
+		uint32_t state = 2463534242u;
+		for (int i = 0; i < buffersNum; i++)
+		{
+			sizes[i] = 65536 << (BenchRandom(state) % 4);
+			buffers[i] = (uint8_t *)HeapAlloc(sizes[i]);
+			if (!buffers[i])
+				sizes[i] = 0;
+			else
+				memset(buffers[i], i, sizes[i]);
+		}
+
+		uint64_t sum = 0;
+		double start = BenchNow();
+		for (int i = 0; i < reads; i++)
+		{
+			uint32_t random = BenchRandom(state);
+			int buffer = random % buffersNum;
+			if (sizes[buffer])
+				sum += buffers[buffer][(random >> 10) % sizes[buffer]];
+		}
+		double time = BenchNow() - start;
+		printf("  %-12s %6.2f ns/read (checksum %llu)\n", names[mode], time / reads, (unsigned long long)sum);
+	}
+	UnmapPool();
+}
+#endif /* __linux__ */
+
+int main(int argc, char ** argv)
+{
+	if (argc > 1 && !strcmp(argv[1], "bench"))
+	{
+		BenchFreeLists();
+		BenchGeometry();
+		BenchRelease();
+#ifdef __linux__
+		BenchHugePages();
+#endif
+		return 0;
+	}
+
 	TestRef();
+	TestHandles();
+	TestRemoteFree();
+	TestCalloc();
+	TestOutOfBand();
+	TestMarkRelease(0);
+	TestMarkRelease(HEAP_OUT_OF_BAND | HEAP_ZEROED);
+#ifdef __linux__
+	TestMapped();
+#endif
+#ifdef BUDDY_TRACE
+	DebugTraceInfo();
+#endif
 
 	return 0;
 }